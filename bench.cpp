@@ -0,0 +1,149 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include "util.h"
+
+/*
+ * Loopback throughput of write_packet/read_packet over plaintext, userspace TLS, and kTLS.
+ * A receiver thread accepts one connection and reads packets, while main thread writes them.
+ */
+
+int packet_count, packet_size;
+int listen_fd;
+SSL_CTX *server_ctx, *client_ctx;
+
+double now() {
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/*
+ * Make self-signed certificate in memory, so that no file is needed.
+ */
+void make_ctx() {
+    EVP_PKEY *pkey = EVP_EC_gen("P-256");
+    if (!pkey) myerror_exit("EVP_EC_gen failed");
+
+    X509 *x509 = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x509), 60 * 60);
+    X509_set_pubkey(x509, pkey);
+    X509_NAME *name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+    X509_set_issuer_name(x509, name);
+    X509_EXTENSION *san = X509V3_EXT_conf_nid(NULL, NULL, NID_subject_alt_name, (char*)"IP:127.0.0.1");
+    if (!san || !X509_add_ext(x509, san, -1)) myerror_exit("failed to add subjectAltName");
+    X509_EXTENSION_free(san);
+    if (!X509_sign(x509, pkey, EVP_sha256())) myerror_exit("X509_sign failed");
+
+    server_ctx = tls_ctx_new(true);
+    if (!server_ctx) myerror_exit("SSL_CTX_new failed");
+    if (SSL_CTX_use_certificate(server_ctx, x509) != 1) myerror_exit("SSL_CTX_use_certificate failed");
+    if (SSL_CTX_use_PrivateKey(server_ctx, pkey) != 1) myerror_exit("SSL_CTX_use_PrivateKey failed");
+
+    client_ctx = tls_ctx_new(false);
+    if (!client_ctx) myerror_exit("SSL_CTX_new failed");
+    X509_STORE_add_cert(SSL_CTX_get_cert_store(client_ctx), x509);
+    X509_VERIFY_PARAM_set1_ip_asc(SSL_CTX_get0_param(client_ctx), "127.0.0.1");
+    SSL_CTX_set_verify(client_ctx, SSL_VERIFY_PEER, NULL);
+
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+}
+
+void* handle_recv(void *arg) {
+    SSL_CTX *ctx = (SSL_CTX*)arg;
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) perror_exit();
+    if (!tls_handshake(ctx, fd, true)) myerror_exit("TLS handshake failed");
+
+    for (int i = 0; i < packet_count; ++i) {
+        char *pr = read_packet(fd);
+        if (!pr) break;
+        free(pr);
+    }
+    tls_close(fd);
+    return NULL;
+}
+
+/*
+ * Run one round. Returns false if kTLS was requested but not available.
+ */
+bool run(const char *mode, bool use_tls, bool use_ktls) {
+    tls_ktls_enabled = use_ktls;
+
+    pthread_t recv_tid;
+    pthread_create(&recv_tid, NULL, handle_recv, use_tls ? server_ctx : NULL);
+
+    sockaddr_in addr;
+    socklen_t addrlen = sizeof(sockaddr_in);
+    if (getsockname(listen_fd, (sockaddr*)&addr, &addrlen) == -1) perror_exit();
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) perror_exit();
+    if (connect(fd, (sockaddr*)&addr, sizeof(sockaddr_in)) == -1) perror_exit();
+    if (!tls_handshake(use_tls ? client_ctx : NULL, fd, false)) myerror_exit("TLS handshake failed");
+
+    tls_conn *conn = tls_find(fd);
+    if (use_ktls && !(conn && conn->ktls_tx && conn->ktls_rx)) {
+        tls_close(fd);
+        pthread_join(recv_tid, NULL);
+        printf("%-10s skipped (kTLS unavailable)\n", mode);
+        return false;
+    }
+
+    double start = now();
+    for (int i = 0; i < packet_count; ++i) {
+        char *ps = (char*)malloc(packet_size);
+        memset(ps, i, packet_size);
+        if (!write_packet(fd, ps, packet_size)) myerror_exit("failed to write packet");
+    }
+    pthread_join(recv_tid, NULL);
+    double elapsed = now() - start;
+    tls_close(fd);
+
+    double bytes = (double)packet_count * (packet_size + sizeof(int));
+    printf("%-10s %10.1f MB/s %12.0f packets/s\n", mode, bytes / elapsed / 1e6, packet_count / elapsed);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 1 && argc != 3) {
+        fprintf(stderr, "Usage: %s ([packet count] [packet size])\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    packet_count = argc == 3 ? atoi(argv[1]) : 100000;
+    packet_size = argc == 3 ? atoi(argv[2]) : 1024;
+
+    make_ctx();
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1) perror_exit();
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listen_fd, (sockaddr*)&addr, sizeof(sockaddr_in)) == -1) perror_exit();
+    if (listen(listen_fd, 1)) perror_exit();
+
+    printf("%d packets of %d bytes\n", packet_count, packet_size);
+    run("plaintext", false, false);
+    run("tls", true, false);
+    run("ktls", true, true);
+
+    close(listen_fd);
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(client_ctx);
+
+    return 0;
+}
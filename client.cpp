@@ -9,6 +9,7 @@
 #include "util.h"
 
 int fd;
+SSL_CTX *tls_ctx = NULL; // NULL if plaintext
 const int BUFSZ = 256;
 char buf[BUFSZ];
 
@@ -50,7 +51,7 @@ void* handle_send(void *arg) {
             generate_int(&psc, 2);
             if (!write_packet(fd, ps, pssz)) myerror_exit("");
             printf("Leaving...\n");
-            close(fd);
+            tls_shutdown(fd); // main thread may still be reading
             exit(0);
         } else if (strncmp(buf, "/exit", 5) == 0) { // exit
             int pssz = sizeof(int) * 2;
@@ -59,7 +60,7 @@ void* handle_send(void *arg) {
             generate_int(&psc, 3);
             if (!write_packet(fd, ps, pssz)) myerror_exit("");
             printf("Exiting...\n");
-            close(fd);
+            tls_shutdown(fd); // main thread may still be reading
             exit(0);
         } else { // normal msg
             int pssz = sizeof(int) * 3 + msg_len;
@@ -74,8 +75,8 @@ void* handle_send(void *arg) {
 }
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s [ip] [port]\n", argv[0]);
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s [ip] [port] ([ca] for TLS)\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -92,6 +93,12 @@ int main(int argc, char **argv) {
     if (inet_aton(server_ip, &server_addr.sin_addr) == 0) myerror_exit("wrong IPv4 address");
     if (connect(server_sockfd, (sockaddr*)&server_addr, sizeof(sockaddr_in)) == -1) perror_exit();
 
+    if (argc == 4) {
+        tls_ctx = tls_client_ctx(argv[3], server_ip);
+        if (!tls_ctx) myerror_exit("failed to load TLS CA");
+        if (!tls_handshake(tls_ctx, server_sockfd, false)) myerror_exit("TLS handshake failed");
+    }
+
     fd = server_sockfd;
     int unread;
     while (true) { // login loop
@@ -226,7 +233,7 @@ int main(int argc, char **argv) {
         }
     }
 
-    close(server_sockfd);
+    tls_close(server_sockfd);
 
     return 0;
 }
@@ -18,6 +18,7 @@ struct thread_info {
 const int MAX_USER = 4;
 int user_fd[MAX_USER] = {-1, -1, -1, -1};
 bool in_group[MAX_USER] = {true, false, false, false};
+SSL_CTX *tls_ctx = NULL; // NULL if plaintext
 
 /*
  * Every time event happened (msg, invitation, and etc.), event is pushed into eq.
@@ -50,7 +51,7 @@ void* handle_eq(void *arg) {
                 int pssz = eq[i].front().pssz;
                 eq[i].pop();
                 if (!write_packet(user_fd[i], ps, pssz)) {
-                    close(user_fd[i]);
+                    shutdown(user_fd[i], SHUT_RDWR); // handle_client thread closes it
                     user_fd[i] = -1;
                     fprintf(stderr, "failed to write packet (uid = %d)\n", i);
                 }
@@ -235,7 +236,6 @@ void process_packets(thread_info *tinfo) {
                 generate_int(&psc, 5);
                 generate_int(&psc, 2);
                 generate_int(&psc, uid);
-                close(fd);
                 user_fd[uid] = -1;
                 in_group[uid] = false;
                 pthread_mutex_lock(&eql);
@@ -252,7 +252,6 @@ void process_packets(thread_info *tinfo) {
                 generate_int(&psc, 5);
                 generate_int(&psc, 3);
                 generate_int(&psc, uid);
-                close(fd);
                 user_fd[uid] = -1;
                 broadcast(ps, pssz);
                 fprintf(stderr, "exit (uid = %d)\n", uid);
@@ -278,20 +277,41 @@ void* handle_client(void *arg) {
 
     fprintf(stderr, "Thread (tnum = %d) is created.\n", tinfo->tnum);
 
-    process_packets(tinfo);
+    if (tls_handshake(tls_ctx, tinfo->client_sockfd, true)) {
+        tls_conn *conn = tls_find(tinfo->client_sockfd);
+        if (conn) {
+            fprintf(stderr, "TLS established (tnum = %d, %s, tx = %s, rx = %s)\n", tinfo->tnum,
+                    SSL_get_cipher_name(conn->ssl),
+                    conn->ktls_tx ? "kernel" : "userspace", conn->ktls_rx ? "kernel" : "userspace");
+        }
+        process_packets(tinfo);
+    } else {
+        fprintf(stderr, "TLS handshake failed (tnum = %d)\n", tinfo->tnum);
+    }
 
-    close(tinfo->client_sockfd);
+    // close under eql, so that handle_eq never writes to a closed (or reused) fd
+    pthread_mutex_lock(&eql);
+    for (int i = 0; i < MAX_USER; ++i) {
+        if (user_fd[i] == tinfo->client_sockfd) user_fd[i] = -1;
+    }
+    tls_close(tinfo->client_sockfd);
+    pthread_mutex_unlock(&eql);
     free(tinfo);
 }
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s [port]\n", argv[0]);
+    if (argc != 2 && argc != 4) {
+        fprintf(stderr, "Usage: %s [port] ([cert] [key] for TLS)\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
     int server_port = atoi(argv[1]);
 
+    if (argc == 4) {
+        tls_ctx = tls_server_ctx(argv[2], argv[3]);
+        if (!tls_ctx) myerror_exit("failed to load TLS certificate");
+    }
+
     int server_sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_sockfd == -1) perror_exit();
 
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+/*
+ * Optional TLS 1.3 transport.
+ * Each encrypted fd has a tls_conn in tls_conns[fd]; plaintext fds have NULL.
+ * OpenSSL moves the connection into the kernel (kTLS, SSL_OP_ENABLE_KTLS) when it can,
+ * so that myread/mywritev keep using plain read/writev on the socket.
+ * Directions that could not be offloaded fall back to SSL_read/SSL_write.
+ * In that case the socket is non-blocking, and lock serializes SSL calls between
+ * the reader thread and the writer thread.
+ */
+struct tls_conn {
+    SSL *ssl;
+    bool ktls_tx, ktls_rx;
+    bool broken; // fatal SSL error occurred, so SSL_shutdown must not be called
+    pthread_mutex_t lock;
+    char client_secret[EVP_MAX_MD_SIZE], server_secret[EVP_MAX_MD_SIZE];
+    int client_secret_len, server_secret_len;
+};
+
+const int TLS_MAX_FD = 1024;
+tls_conn *tls_conns[TLS_MAX_FD];
+bool tls_ktls_enabled = true; // set to false to force userspace TLS
+
+tls_conn* tls_find(int fd) {
+    if (fd < 0 || fd >= TLS_MAX_FD) return NULL;
+    return tls_conns[fd];
+}
+
+/*
+ * Parse "<label> <client_random> <secret>" keylog lines to capture the application traffic secrets.
+ * OpenSSL 3.0 offloads only TX of TLS 1.3 to the kernel (RX is supported from 3.2),
+ * so RX keys are derived from these secrets and installed by tls_install_ktls_rx.
+ */
+void tls_keylog_cb(const SSL *ssl, const char *line) {
+    tls_conn *conn = (tls_conn*)SSL_get_app_data(ssl);
+    if (!conn) return;
+
+    char *secret;
+    int *secret_len;
+    if (strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24) == 0) {
+        secret = conn->client_secret;
+        secret_len = &conn->client_secret_len;
+    } else if (strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24) == 0) {
+        secret = conn->server_secret;
+        secret_len = &conn->server_secret_len;
+    } else {
+        return;
+    }
+
+    const char *hex = strrchr(line, ' ') + 1;
+    int n = strlen(hex) / 2;
+    if (n > EVP_MAX_MD_SIZE) return;
+    for (int i = 0; i < n; ++i) {
+        unsigned int x;
+        if (sscanf(hex + i * 2, "%2x", &x) != 1) return;
+        secret[i] = x;
+    }
+    *secret_len = n;
+}
+
+/*
+ * HKDF-Expand-Label(secret, label, "", len) of RFC 8446.
+ * len never exceeds the hash size here, so a single HMAC block is enough.
+ */
+bool tls_expand_label(const EVP_MD *md, char *secret, int secret_len, const char *label, unsigned char *out, int len) {
+    unsigned char info[64], *p = info;
+    int label_len = 6 + strlen(label);
+    *p++ = len >> 8;
+    *p++ = len & 0xff;
+    *p++ = label_len;
+    memcpy(p, "tls13 ", 6);
+    memcpy(p + 6, label, label_len - 6);
+    p += label_len;
+    *p++ = 0; // empty context
+    *p++ = 1; // HKDF-Expand block counter
+
+    unsigned char block[EVP_MAX_MD_SIZE];
+    unsigned int block_len;
+    if (!HMAC(md, secret, secret_len, info, p - info, block, &block_len)) return false;
+    if ((int)block_len < len) return false;
+    memcpy(out, block, len);
+    return true;
+}
+
+/*
+ * Derive key/iv from traffic secret and install it to one direction (TLS_TX or TLS_RX) of the socket.
+ * Record sequence number starts from 0, as no record is sent with application keys before this
+ * (session tickets are disabled), and OpenSSL does not expose the sequence number.
+ */
+bool tls_install_key(int fd, int dir, const SSL_CIPHER *cipher, char *secret, int secret_len) {
+    int key_len;
+    const EVP_MD *md;
+    if (SSL_CIPHER_get_id(cipher) == TLS1_3_CK_AES_128_GCM_SHA256) {
+        key_len = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+        md = EVP_sha256();
+    } else if (SSL_CIPHER_get_id(cipher) == TLS1_3_CK_AES_256_GCM_SHA384) {
+        key_len = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+        md = EVP_sha384();
+    } else {
+        return false;
+    }
+
+    unsigned char key[32], iv[12];
+    if (!tls_expand_label(md, secret, secret_len, "key", key, key_len)) return false;
+    if (!tls_expand_label(md, secret, secret_len, "iv", iv, sizeof(iv))) return false;
+
+    int ret;
+    if (key_len == TLS_CIPHER_AES_GCM_128_KEY_SIZE) {
+        tls12_crypto_info_aes_gcm_128 ci;
+        memset(&ci, 0, sizeof(ci));
+        ci.info.version = TLS_1_3_VERSION;
+        ci.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(ci.salt, iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+        memcpy(ci.iv, iv + TLS_CIPHER_AES_GCM_128_SALT_SIZE, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+        memcpy(ci.key, key, key_len);
+        ret = setsockopt(fd, SOL_TLS, dir, &ci, sizeof(ci));
+        OPENSSL_cleanse(&ci, sizeof(ci));
+    } else {
+        tls12_crypto_info_aes_gcm_256 ci;
+        memset(&ci, 0, sizeof(ci));
+        ci.info.version = TLS_1_3_VERSION;
+        ci.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(ci.salt, iv, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+        memcpy(ci.iv, iv + TLS_CIPHER_AES_GCM_256_SALT_SIZE, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+        memcpy(ci.key, key, key_len);
+        ret = setsockopt(fd, SOL_TLS, dir, &ci, sizeof(ci));
+        OPENSSL_cleanse(&ci, sizeof(ci));
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+    return ret == 0;
+}
+
+/*
+ * Check which directions OpenSSL has offloaded, and install RX by hand if OpenSSL could not.
+ * RX is tried only when OpenSSL attached the tls ULP for TX, i.e. the kernel supports kTLS.
+ */
+void tls_install_ktls(int fd, tls_conn *conn, bool is_server) {
+    conn->ktls_tx = BIO_get_ktls_send(SSL_get_wbio(conn->ssl));
+    conn->ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(conn->ssl));
+    if (!conn->ktls_tx || conn->ktls_rx) return;
+
+    char *rx = is_server ? conn->client_secret : conn->server_secret;
+    int rx_len = is_server ? conn->client_secret_len : conn->server_secret_len;
+    if (rx_len == 0) return;
+    conn->ktls_rx = tls_install_key(fd, TLS_RX, SSL_get_current_cipher(conn->ssl), rx, rx_len);
+}
+
+/*
+ * Only TLS 1.3 with AES-GCM is allowed, because those are what kTLS can take over.
+ */
+SSL_CTX* tls_ctx_new(bool is_server) {
+    SSL_CTX *ctx = SSL_CTX_new(is_server ? TLS_server_method() : TLS_client_method());
+    if (!ctx) return NULL;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+    SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384");
+    SSL_CTX_set_num_tickets(ctx, 0);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    SSL_CTX_set_keylog_callback(ctx, tls_keylog_cb);
+    return ctx;
+}
+
+/*
+ * Server presents cert_file; client verifies that the server certificate is signed by ca_file
+ * and issued for server_ip (subjectAltName IP).
+ */
+SSL_CTX* tls_server_ctx(const char *cert_file, const char *key_file) {
+    SSL_CTX *ctx = tls_ctx_new(true);
+    if (!ctx) return NULL;
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1
+            || SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+SSL_CTX* tls_client_ctx(const char *ca_file, const char *server_ip) {
+    SSL_CTX *ctx = tls_ctx_new(false);
+    if (!ctx) return NULL;
+    if (SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1
+            || X509_VERIFY_PARAM_set1_ip_asc(SSL_CTX_get0_param(ctx), server_ip) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    return ctx;
+}
+
+/*
+ * Do TLS handshake on fd, and register the connection.
+ * Returns false on failure. Does nothing if ctx is NULL (plaintext mode).
+ */
+bool tls_handshake(SSL_CTX *ctx, int fd, bool is_server) {
+    if (!ctx) return true;
+    if (fd < 0 || fd >= TLS_MAX_FD) {
+        fprintf(stderr, "fd %d exceeds TLS_MAX_FD (%d)\n", fd, TLS_MAX_FD);
+        return false;
+    }
+
+    tls_conn *conn = (tls_conn*)calloc(1, sizeof(tls_conn));
+    pthread_mutex_init(&conn->lock, NULL);
+    conn->ssl = SSL_new(ctx);
+    SSL_set_app_data(conn->ssl, conn);
+    if (tls_ktls_enabled) SSL_set_options(conn->ssl, SSL_OP_ENABLE_KTLS);
+    SSL_set_fd(conn->ssl, fd);
+    int ret = is_server ? SSL_accept(conn->ssl) : SSL_connect(conn->ssl);
+    if (ret != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(conn->ssl);
+        pthread_mutex_destroy(&conn->lock);
+        free(conn);
+        return false;
+    }
+
+    tls_install_ktls(fd, conn, is_server);
+    OPENSSL_cleanse(conn->client_secret, sizeof(conn->client_secret));
+    OPENSSL_cleanse(conn->server_secret, sizeof(conn->server_secret));
+    if (!conn->ktls_tx || !conn->ktls_rx) {
+        int flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    tls_conns[fd] = conn;
+    return true;
+}
+
+/*
+ * Wait until fd becomes readable or writable.
+ */
+void tls_wait(int fd, short events) {
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR);
+}
+
+/*
+ * SSL_read/SSL_write for the directions not offloaded to the kernel.
+ * Returns number of bytes transferred, or 0 when connection is closed or broken.
+ */
+int tls_io(int fd, tls_conn *conn, void *buf, int count, bool is_write) {
+    while (true) {
+        pthread_mutex_lock(&conn->lock);
+        int ret = is_write ? SSL_write(conn->ssl, buf, count) : SSL_read(conn->ssl, buf, count);
+        int err = SSL_get_error(conn->ssl, ret);
+        if (err == SSL_ERROR_SYSCALL || err == SSL_ERROR_SSL) {
+            conn->broken = true;
+            ERR_clear_error();
+        }
+        pthread_mutex_unlock(&conn->lock);
+
+        if (ret > 0) return ret;
+        if (err == SSL_ERROR_WANT_READ) {
+            tls_wait(fd, POLLIN);
+        } else if (err == SSL_ERROR_WANT_WRITE) {
+            tls_wait(fd, POLLOUT);
+        } else {
+            return 0;
+        }
+    }
+}
+
+/*
+ * Send close_notify unless the connection is broken.
+ * With kTLS TX, OpenSSL sends it as a control message through the kernel.
+ */
+void tls_send_close_notify(tls_conn *conn) {
+    pthread_mutex_lock(&conn->lock);
+    if (!conn->broken) {
+        SSL_shutdown(conn->ssl);
+        ERR_clear_error();
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+/*
+ * Shut down fd without freeing anything, so that another thread may still be using it.
+ * The thread owning fd should call tls_close later.
+ */
+void tls_shutdown(int fd) {
+    tls_conn *conn = tls_find(fd);
+    if (conn) tls_send_close_notify(conn);
+    shutdown(fd, SHUT_RDWR);
+}
+
+/*
+ * Unregister fd (sending close_notify if possible) and close it.
+ */
+void tls_close(int fd) {
+    tls_conn *conn = tls_find(fd);
+    if (conn) {
+        tls_conns[fd] = NULL;
+        tls_send_close_notify(conn);
+        SSL_free(conn->ssl);
+        pthread_mutex_destroy(&conn->lock);
+        free(conn);
+    }
+    close(fd);
+}
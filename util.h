@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #define errno_perror_exit(e) \
     do {\
@@ -25,29 +26,78 @@
         exit(EXIT_FAILURE);\
     } while (false)
 
+#include "tls.h"
+
+void generate_bytes(char* *packet, char *bytes, int n) {
+    memcpy(*packet, bytes, n);
+    *packet += n;
+}
+
 bool myread(int fd, void *_buf, size_t count) {
     char *buf = (char*)_buf;
+    tls_conn *conn = tls_find(fd);
+    if (conn && !conn->ktls_rx) { // userspace TLS
+        while (count > 0) {
+            int ret = tls_io(fd, conn, buf, count, false);
+            if (ret == 0) break;
+            buf += ret;
+            count -= ret;
+        }
+        return count == 0;
+    }
     do {
         ssize_t ret = read(fd, buf, count);
         if (ret == 0) break;
+        if (ret == -1 && errno == EAGAIN) { tls_wait(fd, POLLIN); continue; }
+        if (ret == -1 && conn && errno != EINTR && errno != EAGAIN) { // kTLS got an alert or a bad record
+            pthread_mutex_lock(&conn->lock);
+            conn->broken = true;
+            pthread_mutex_unlock(&conn->lock);
+            break;
+        }
         if (ret == -1 && errno != EINTR) perror_exit();
+        if (ret == -1) continue;
         buf += ret;
         count -= ret;
     } while (count > 0);
     return count == 0;
 }
 
-bool mywrite(int fd, void *_buf, size_t count) {
-    char *buf = (char*)_buf;
-    do {
-        ssize_t ret = write(fd, buf, count);
+/*
+ * Write all iovecs in a single syscall when possible,
+ * so that a packet is sent as one segment (or one TLS record).
+ */
+bool mywritev(int fd, iovec *iov, int iovcnt) {
+    tls_conn *conn = tls_find(fd);
+    if (conn && !conn->ktls_tx) { // userspace TLS : coalesce into one record
+        const int STACK_BUFSZ = 16384; // max TLS record payload
+        char stack_buf[STACK_BUFSZ];
+        size_t count = 0;
+        for (int i = 0; i < iovcnt; ++i) count += iov[i].iov_len;
+        char *buf = count <= STACK_BUFSZ ? stack_buf : (char*)malloc(count), *bufc = buf;
+        for (int i = 0; i < iovcnt; ++i) generate_bytes(&bufc, (char*)iov[i].iov_base, iov[i].iov_len);
+        bool ret = tls_io(fd, conn, buf, count, true) == (int)count;
+        if (buf != stack_buf) free(buf);
+        return ret;
+    }
+    while (iovcnt > 0) {
+        ssize_t ret = writev(fd, iov, iovcnt);
         if (ret == 0) break;
+        if (ret == -1 && errno == EAGAIN) { tls_wait(fd, POLLOUT); continue; }
         if (ret == -1 && errno == EBADF) break;
         if (ret == -1 && errno != EINTR) perror_exit();
-        buf += ret;
-        count -= ret;
-    } while (count > 0);
-    return count == 0;
+        if (ret == -1) continue;
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return iovcnt == 0;
 }
 
 char* read_packet(int fd) {
@@ -64,7 +114,12 @@ char* read_packet(int fd) {
 }
 
 bool write_packet(int fd, char *packet, int sz) {
-    bool ret = mywrite(fd, &sz, sizeof(int)) && mywrite(fd, packet, sz);
+    iovec iov[2];
+    iov[0].iov_base = &sz;
+    iov[0].iov_len = sizeof(int);
+    iov[1].iov_base = packet;
+    iov[1].iov_len = sz;
+    bool ret = mywritev(fd, iov, 2);
     free(packet);
     return ret;
 }
@@ -82,11 +137,6 @@ int consume_int(char* *packet) {
     return x;
 }
 
-void generate_bytes(char* *packet, char *bytes, int n) {
-    memcpy(*packet, bytes, n);
-    *packet += n;
-}
-
 void generate_int(char* *packet, int x) {
     *(int*)*packet = x;
     *packet += sizeof(int);